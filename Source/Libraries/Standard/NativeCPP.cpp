@@ -15,6 +15,7 @@
 #include <inttypes.h>
 #include <exception>
 #include <cstddef>
+#include <chrono>
 
 #if !defined(ROGUE_PLATFORM_WINDOWS)
 #  include <sys/time.h>
@@ -57,6 +58,8 @@
 bool               Rogue_gc_logging   = false;
 int                Rogue_gc_threshold = ROGUE_GC_THRESHOLD_DEFAULT;
 int                Rogue_gc_count     = 0; // Purely informational
+RogueInt64         Rogue_gc_microseconds = 0; // Purely informational
+bool               Rogue_count_allocations = false; // See Runtime.count_allocations()
 bool               Rogue_gc_requested = false;
 bool               Rogue_gc_active    = false; // Are we collecting right now?
 RogueLogical       Rogue_configured = 0;
@@ -71,6 +74,283 @@ ROGUE_THREAD_LOCAL RogueDebugTrace* Rogue_call_stack = 0;
 struct RogueWeakReference;
 RogueWeakReference* Rogue_weak_references = 0;
 
+//-----------------------------------------------------------------------------
+//  Topology
+//-----------------------------------------------------------------------------
+#if defined(__linux__)
+#  include <sched.h>
+#endif
+
+// One set of Rogue_allocator_count allocators per NUMA node; set 0 is
+// Rogue_allocators itself.  Without ROGUE_NUMA there is only set 0.
+static int             Rogue_allocator_set_count = 1;
+static RogueAllocator* Rogue_allocator_sets[ ROGUE_NUMA_NODE_LIMIT ];
+
+#if ROGUE_NUMA
+static ROGUE_THREAD_LOCAL int Rogue_numa_node = 0;  // index of this thread's allocator set
+#endif
+
+static bool          RogueTopology_loaded = false;
+static int           RogueTopology_count = 0;
+static int           RogueTopology_nodes = 1;
+static RogueCPUInfo* RogueTopology_cpus = 0;
+static int*          RogueTopology_compact_order = 0;
+static int*          RogueTopology_scatter_order = 0;
+static int*          RogueTopology_scatter_rank = 0;
+static int           RogueTopology_node_by_id[ ROGUE_TOPOLOGY_CPU_LIMIT ];
+
+#if defined(__linux__)
+static bool RogueTopology_read_int( const char* path, int* value )
+{
+  FILE* fp = fopen( path, "r" );
+  if ( !fp ) return false;
+  bool ok = (fscanf( fp, "%d", value ) == 1);
+  fclose( fp );
+  return ok;
+}
+
+static bool RogueTopology_read_list( const char* path, cpu_set_t* set )
+{
+  // Parses a sysfs list such as "0-3,8-11".
+  FILE* fp = fopen( path, "r" );
+  if ( !fp ) return false;
+  CPU_ZERO( set );
+  int first, last;
+  while (fscanf( fp, "%d", &first ) == 1)
+  {
+    last = first;
+    int ch = fgetc( fp );
+    if (ch == '-')
+    {
+      if (fscanf( fp, "%d", &last ) != 1) break;
+      ch = fgetc( fp );
+    }
+    for (int i=first; i<=last && i<CPU_SETSIZE; ++i) CPU_SET( i, set );
+    if (ch != ',') break;
+  }
+  fclose( fp );
+  return true;
+}
+#endif
+
+static int RogueTopology_compare_compact( const void* a, const void* b )
+{
+  // Node, then package, then core, then hardware thread.
+  RogueCPUInfo* cpu_a = &RogueTopology_cpus[ *(const int*)a ];
+  RogueCPUInfo* cpu_b = &RogueTopology_cpus[ *(const int*)b ];
+  if (cpu_a->node != cpu_b->node)       return cpu_a->node - cpu_b->node;
+  if (cpu_a->package != cpu_b->package) return cpu_a->package - cpu_b->package;
+  if (cpu_a->core != cpu_b->core)       return cpu_a->core - cpu_b->core;
+  if (cpu_a->thread != cpu_b->thread)   return cpu_a->thread - cpu_b->thread;
+  return cpu_a->id - cpu_b->id;
+}
+
+static int RogueTopology_compare_scatter( const void* a, const void* b )
+{
+  // First hardware threads before siblings, then the n-th core of each node
+  // before the (n+1)-th of any.
+  int index_a = *(const int*)a;
+  int index_b = *(const int*)b;
+  RogueCPUInfo* cpu_a = &RogueTopology_cpus[ index_a ];
+  RogueCPUInfo* cpu_b = &RogueTopology_cpus[ index_b ];
+  if (cpu_a->thread != cpu_b->thread) return cpu_a->thread - cpu_b->thread;
+  int rank_a = RogueTopology_scatter_rank[ index_a ];
+  int rank_b = RogueTopology_scatter_rank[ index_b ];
+  if (rank_a != rank_b) return rank_a - rank_b;
+  if (cpu_a->node != cpu_b->node) return cpu_a->node - cpu_b->node;
+  return cpu_a->id - cpu_b->id;
+}
+
+static void RogueTopology_load()
+{
+  if (RogueTopology_loaded) return;
+  RogueTopology_loaded = true;
+
+  memset( RogueTopology_node_by_id, 0, sizeof(RogueTopology_node_by_id) );
+
+#if defined(__linux__)
+  cpu_set_t usable;
+  if (sched_getaffinity( 0, sizeof(usable), &usable ) != 0)
+  {
+    CPU_ZERO( &usable );
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+    for (long i=0; i<n && i<CPU_SETSIZE; ++i) CPU_SET( (int)i, &usable );
+  }
+
+  RogueTopology_count = CPU_COUNT( &usable );
+  if (RogueTopology_count < 1) RogueTopology_count = 1;
+  RogueTopology_cpus = new RogueCPUInfo[ RogueTopology_count ];
+
+  // Nodes without usable CPUs (memory-only or outside our cpuset) are skipped
+  // so that node numbers stay dense.
+  cpu_set_t nodes;
+  RogueTopology_nodes = 0;
+  if (RogueTopology_read_list( "/sys/devices/system/node/online", &nodes ))
+  {
+    char path[PATH_MAX];
+    for (int node_id=0; node_id<CPU_SETSIZE; ++node_id)
+    {
+      if ( !CPU_ISSET(node_id,&nodes) ) continue;
+      cpu_set_t node_cpus;
+      snprintf( path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node_id );
+      if ( !RogueTopology_read_list(path,&node_cpus) ) continue;
+      CPU_AND( &node_cpus, &node_cpus, &usable );
+      if ( !CPU_COUNT(&node_cpus) ) continue;
+      for (int id=0; id<CPU_SETSIZE && id<ROGUE_TOPOLOGY_CPU_LIMIT; ++id)
+      {
+        if (CPU_ISSET(id,&node_cpus)) RogueTopology_node_by_id[id] = RogueTopology_nodes;
+      }
+      ++RogueTopology_nodes;
+    }
+  }
+  if ( !RogueTopology_nodes ) RogueTopology_nodes = 1;
+
+  int count = 0;
+  for (int id=0; id<CPU_SETSIZE && count<RogueTopology_count; ++id)
+  {
+    if ( !CPU_ISSET(id,&usable) ) continue;
+    RogueCPUInfo* cpu = &RogueTopology_cpus[ count++ ];
+    char path[PATH_MAX];
+    cpu->id = id;
+    cpu->node = (id < ROGUE_TOPOLOGY_CPU_LIMIT) ? RogueTopology_node_by_id[id] : 0;
+    snprintf( path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", id );
+    if ( !RogueTopology_read_int(path,&cpu->package) ) cpu->package = 0;
+    snprintf( path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", id );
+    if ( !RogueTopology_read_int(path,&cpu->core) ) cpu->core = id;
+  }
+  RogueTopology_count = count;
+#else
+  #if defined(ROGUE_PLATFORM_WINDOWS)
+    RogueTopology_count = 1;
+  #else
+    RogueTopology_count = (int) sysconf( _SC_NPROCESSORS_ONLN );
+  #endif
+  if (RogueTopology_count < 1) RogueTopology_count = 1;
+  RogueTopology_cpus = new RogueCPUInfo[ RogueTopology_count ];
+  for (int i=0; i<RogueTopology_count; ++i)
+  {
+    RogueCPUInfo* cpu = &RogueTopology_cpus[i];
+    cpu->id = i;
+    cpu->node = 0;
+    cpu->package = 0;
+    cpu->core = i;
+  }
+#endif
+
+  // Number each core's hardware threads in CPU id order.
+  for (int i=0; i<RogueTopology_count; ++i)
+  {
+    RogueCPUInfo* cpu = &RogueTopology_cpus[i];
+    cpu->thread = 0;
+    for (int j=0; j<i; ++j)
+    {
+      RogueCPUInfo* other = &RogueTopology_cpus[j];
+      if (other->package == cpu->package && other->core == cpu->core) ++cpu->thread;
+    }
+  }
+
+  RogueTopology_compact_order = new int[ RogueTopology_count ];
+  RogueTopology_scatter_order = new int[ RogueTopology_count ];
+  RogueTopology_scatter_rank  = new int[ RogueTopology_count ];
+  for (int i=0; i<RogueTopology_count; ++i) RogueTopology_compact_order[i] = i;
+  qsort( RogueTopology_compact_order, RogueTopology_count, sizeof(int), RogueTopology_compare_compact );
+
+  // A CPU's scatter rank is its position among the CPUs of the same node and
+  // hardware thread number, in compact order.
+  int* seen = new int[ RogueTopology_nodes * RogueTopology_count ]();
+  for (int i=0; i<RogueTopology_count; ++i)
+  {
+    int index = RogueTopology_compact_order[i];
+    RogueCPUInfo* cpu = &RogueTopology_cpus[ index ];
+    RogueTopology_scatter_rank[ index ] = seen[ cpu->node * RogueTopology_count + cpu->thread ]++;
+  }
+  delete[] seen;
+
+  for (int i=0; i<RogueTopology_count; ++i) RogueTopology_scatter_order[i] = i;
+  qsort( RogueTopology_scatter_order, RogueTopology_count, sizeof(int), RogueTopology_compare_scatter );
+}
+
+int RogueTopology_cpu_count()
+{
+  RogueTopology_load();
+  return RogueTopology_count;
+}
+
+RogueCPUInfo* RogueTopology_cpu( int index )
+{
+  RogueTopology_load();
+  if (index < 0 || index >= RogueTopology_count) return 0;
+  return &RogueTopology_cpus[ index ];
+}
+
+int RogueTopology_node_count()
+{
+  RogueTopology_load();
+  return RogueTopology_nodes;
+}
+
+int RogueTopology_node_of( int cpu_id )
+{
+  RogueTopology_load();
+  if (cpu_id < 0 || cpu_id >= ROGUE_TOPOLOGY_CPU_LIMIT) return 0;
+  return RogueTopology_node_by_id[ cpu_id ];
+}
+
+int RogueTopology_current_cpu()
+{
+#if defined(__linux__)
+  return sched_getcpu();
+#else
+  return -1;
+#endif
+}
+
+int RogueTopology_current_node()
+{
+  return RogueTopology_node_of( RogueTopology_current_cpu() );
+}
+
+int RogueTopology_placement( int policy, int worker_index )
+{
+  // Returns the CPU id for worker 'worker_index' under 'policy', or -1 for
+  // ROGUE_PLACEMENT_UNPINNED.  Workers beyond the CPU count wrap around.
+  RogueTopology_load();
+  if (worker_index < 0) return -1;
+  int i = worker_index % RogueTopology_count;
+  switch (policy)
+  {
+    case ROGUE_PLACEMENT_COMPACT: return RogueTopology_cpus[ RogueTopology_compact_order[i] ].id;
+    case ROGUE_PLACEMENT_SCATTER: return RogueTopology_cpus[ RogueTopology_scatter_order[i] ].id;
+    default:                      return -1;
+  }
+}
+
+#if ROGUE_NUMA
+static void Rogue_numa_set_node( int node )
+{
+  Rogue_numa_node = (node >= 0) ? node % Rogue_allocator_set_count : 0;
+}
+#endif
+
+bool RogueTopology_pin_current_thread( int cpu_id )
+{
+  // Restricts the calling thread to CPU 'cpu_id' and switches it to that
+  // node's allocators.
+#if defined(__linux__)
+  if (cpu_id < 0 || cpu_id >= CPU_SETSIZE) return false;
+  cpu_set_t cpus;
+  CPU_ZERO( &cpus );
+  CPU_SET( cpu_id, &cpus );
+  if (sched_setaffinity( 0, sizeof(cpus), &cpus ) != 0) return false;
+#if ROGUE_NUMA
+  Rogue_numa_set_node( RogueTopology_node_of(cpu_id) );
+#endif
+  return true;
+#else
+  return false;
+#endif
+}
+
 //-----------------------------------------------------------------------------
 //  Multithreading
 //-----------------------------------------------------------------------------
@@ -142,6 +422,13 @@ static ROGUE_MUTEX_DEF(Rogue_mt_thread_mutex);
 static int Rogue_mt_tc = 0; // Thread count.  Always set under above lock.
 static std::atomic_bool Rogue_mt_terminating(false); // True when terminating.
 
+#if ROGUE_GC_MODE_AUTO_MT
+// RogueMTGCThread holds the safepoint state each registered thread publishes
+// for the GC; see NativeCPP.h and the GC section below.
+static RogueMTGCThread* Rogue_mtgc_threads = 0; // Modified under Rogue_mt_thread_mutex
+thread_local RogueMTGCThread* Rogue_mtgc_this_thread = 0;
+#endif
+
 static void Rogue_thread_register ()
 {
   ROGUE_MUTEX_LOCK(Rogue_mt_thread_mutex);
@@ -149,7 +436,17 @@ static void Rogue_thread_register ()
   int n = (int)Rogue_mt_tc;
 #endif
   ++Rogue_mt_tc;
+#if ROGUE_GC_MODE_AUTO_MT
+  RogueMTGCThread* self = new RogueMTGCThread();
+  self->state = ROGUE_MTGC_RUNNING;
+  self->next = Rogue_mtgc_threads;
+  Rogue_mtgc_threads = self;
+  Rogue_mtgc_this_thread = self;
+#endif
   ROGUE_MUTEX_UNLOCK(Rogue_mt_thread_mutex);
+#if ROGUE_NUMA
+  Rogue_numa_set_node( RogueTopology_current_node() );
+#endif
 #if ROGUE_THREAD_MODE == ROGUE_THREAD_MODE_PTHREADS
   char name[64];
   sprintf(name, "Thread-%i", n); // Nice names are good for valgrind
@@ -170,6 +467,14 @@ static void Rogue_thread_unregister ()
   ROGUE_MUTEX_LOCK(Rogue_mt_thread_mutex);
   ROGUE_ENTER;
   --Rogue_mt_tc;
+#if ROGUE_GC_MODE_AUTO_MT
+  // The GC holds the thread mutex while it runs, so the list is ours to edit.
+  RogueMTGCThread** cur = &Rogue_mtgc_threads;
+  while (*cur != Rogue_mtgc_this_thread) cur = &(*cur)->next;
+  *cur = Rogue_mtgc_this_thread->next;
+  delete Rogue_mtgc_this_thread;
+  Rogue_mtgc_this_thread = 0;
+#endif
   ROGUE_MUTEX_UNLOCK(Rogue_mt_thread_mutex);
 }
 
@@ -211,10 +516,8 @@ static void Rogue_thread_unregister ()
 
 #endif
 
-// Singleton handling
+// Singleton handling (ROGUE_GET_SINGLETON/ROGUE_SET_SINGLETON are in NativeCPP.h)
 #if ROGUE_THREAD_MODE
-#define ROGUE_GET_SINGLETON(_S) (_S)->_singleton.load()
-#define ROGUE_SET_SINGLETON(_S,_V) (_S)->_singleton.store(_V);
 #if ROGUE_THREAD_MODE == ROGUE_THREAD_MODE_PTHREADS
 pthread_mutex_t Rogue_thread_singleton_lock;
 #define ROGUE_SINGLETON_LOCK ROGUE_MUTEX_LOCK(Rogue_thread_singleton_lock);
@@ -225,8 +528,6 @@ std::recursive_mutex Rogue_thread_singleton_lock;
 #define ROGUE_SINGLETON_UNLOCK Rogue_thread_singleton_lock.unlock();
 #endif
 #else
-#define ROGUE_GET_SINGLETON(_S) (_S)->_singleton
-#define ROGUE_SET_SINGLETON(_S,_V) (_S)->_singleton = _V;
 #define ROGUE_SINGLETON_LOCK
 #define ROGUE_SINGLETON_UNLOCK
 #endif
@@ -240,7 +541,7 @@ std::recursive_mutex Rogue_thread_singleton_lock;
 #define ROGUE_GC_VAR static volatile int
 // (Curiously, volatile seems to help performance slightly.)
 
-static thread_local bool Rogue_mtgc_is_gc_thread = false;
+thread_local bool Rogue_mtgc_is_gc_thread = false;
 
 #define ROGUE_MTGC_BARRIER asm volatile("" : : : "memory");
 
@@ -276,20 +577,34 @@ void Rogue_collect_garbage_real_noinline ()
 #endif
 #endif
 
-// This is how unlikely() works in the Linux kernel
-#define ROGUE_UNLIKELY(_X) __builtin_expect(!!(_X), 0)
-
-#define ROGUE_GC_CHECK if (ROGUE_UNLIKELY(Rogue_mtgc_w) \
-  && !ROGUE_UNLIKELY(Rogue_mtgc_is_gc_thread))          \
-  Rogue_mtgc_W2_W3_W4(); // W1
-
- ROGUE_MUTEX_DEF(Rogue_mtgc_w_mutex);
+// Safepoints
+//
+// Each registered thread publishes whether it is running Rogue code in its
+// RogueMTGCThread::state, so ROGUE_EXIT and ROGUE_ENTER are a store plus a
+// load with no locking.  To collect, the GC thread sets Rogue_mtgc_w and waits
+// until no thread is RUNNING.  Threads that are outside Rogue code (blocked in
+// I/O, sleeping, waiting on a lock) are already safe and are never woken.
+// Running threads notice the request at their next poll - a relaxed load and
+// a predicted branch at loop back-edges and at the start of every method that
+// makes calls - and park until the GC is done.
+//
+// Correctness rests on a store-then-load on each side (all sequentially
+// consistent): the GC stores w then reads each state; a thread stores its
+// state then reads w.  So either the GC sees a thread as RUNNING and that
+// thread is guaranteed to see w, or the thread sees w before running any
+// Rogue code.  Only the slow paths touch a mutex.  ROGUE_GC_CHECK itself is
+// defined in NativeCPP.h so that every generated translation unit can poll.
+
+// Wait for all threads to be safe (GC side)
 static ROGUE_MUTEX_DEF(Rogue_mtgc_s_mutex);
-static ROGUE_COND_DEF(Rogue_mtgc_w_cond);
 static ROGUE_COND_DEF(Rogue_mtgc_s_cond);
 
-ROGUE_GC_VAR Rogue_mtgc_w = 0;
-ROGUE_GC_VAR Rogue_mtgc_s = 0;
+// Wait for the GC to finish (thread side)
+static ROGUE_MUTEX_DEF(Rogue_mtgc_w_mutex);
+static ROGUE_COND_DEF(Rogue_mtgc_w_cond);
+
+// 0:normal 1:stop requested 2:collecting (debug builds only)
+std::atomic_int Rogue_mtgc_w(0);
 
 // Only one worker can be "running" (waiting for) the GC at a time.
 // To run, set r = 1, and wait for GC to set it to 0.  If r is already
@@ -306,113 +621,64 @@ static int Rogue_mtgc_should_quit = 0; // 0:normal 1:should-quit 2:has-quit
 
 static ROGUE_THREAD_DEF(Rogue_mtgc_thread);
 
-static void Rogue_mtgc_W2_W3_W4 (void);
-static inline void Rogue_mtgc_W3_W4 (void);
-
-inline void Rogue_mtgc_B1 ()
+void Rogue_mtgc_notify_safe ()
 {
-  ROGUE_COND_NOTIFY_ONE(Rogue_mtgc_s_cond, Rogue_mtgc_s_mutex, ++Rogue_mtgc_s);
+  // Wakes the GC in case it is waiting on this thread.
+  ROGUE_COND_NOTIFY_ONE(Rogue_mtgc_s_cond, Rogue_mtgc_s_mutex, (void)0);
 }
 
-static inline void Rogue_mtgc_B2_etc ()
+void Rogue_mtgc_park ()
 {
-  Rogue_mtgc_W3_W4();
-  // We can probably just do GC_CHECK here rather than this more expensive
-  // locking version.
-  ROGUE_MUTEX_LOCK(Rogue_mtgc_w_mutex);
-  auto w = Rogue_mtgc_w;
-  ROGUE_MUTEX_UNLOCK(Rogue_mtgc_w_mutex);
-  if (ROGUE_UNLIKELY(w)) Rogue_mtgc_W2_W3_W4(); // W1
-}
-
-static inline void Rogue_mtgc_W3_W4 ()
-{
-  // W3
-  ROGUE_COND_WAIT(Rogue_mtgc_w_cond, Rogue_mtgc_w_mutex, Rogue_mtgc_w != 0);
-
-  // W4
-  ROGUE_MUTEX_LOCK(Rogue_mtgc_s_mutex);
-  --Rogue_mtgc_s;
-  ROGUE_MUTEX_UNLOCK(Rogue_mtgc_s_mutex);
-}
-
-static void Rogue_mtgc_W2_W3_W4 ()
-{
-  // W2
-  ROGUE_COND_NOTIFY_ONE(Rogue_mtgc_s_cond, Rogue_mtgc_s_mutex, ++Rogue_mtgc_s);
-  Rogue_mtgc_W3_W4();
-}
-
-
-static thread_local int Rogue_mtgc_entered = 1;
-
-inline void Rogue_mtgc_enter()
-{
-  if (ROGUE_UNLIKELY(Rogue_mtgc_is_gc_thread)) return;
-  if (ROGUE_UNLIKELY(Rogue_mtgc_entered))
-#ifdef ROGUE_MTGC_DEBUG
-  {
-    printf("ALREADY ENTERED\n");
-    exit(1);
-  }
-#else
+  // Slow path of ROGUE_GC_CHECK and ROGUE_ENTER: stay safe until the GC is done.
+  RogueMTGCThread* self = Rogue_mtgc_this_thread;
+  do
   {
-    ++Rogue_mtgc_entered;
-    return;
+    self->state.store( ROGUE_MTGC_SAFE );
+    Rogue_mtgc_notify_safe();
+    ROGUE_COND_WAIT(Rogue_mtgc_w_cond, Rogue_mtgc_w_mutex, Rogue_mtgc_w.load() != 0);
+    self->state.store( ROGUE_MTGC_RUNNING );
   }
-#endif
-
-  Rogue_mtgc_entered = 1;
-  Rogue_mtgc_B2_etc();
+  while (ROGUE_UNLIKELY(Rogue_mtgc_w.load()));
 }
 
-inline void Rogue_mtgc_exit()
+static int Rogue_mtgc_running_count ()
 {
-  if (ROGUE_UNLIKELY(Rogue_mtgc_is_gc_thread)) return;
-  if (ROGUE_UNLIKELY(Rogue_mtgc_entered <= 0))
+  // Called by the GC thread, which holds Rogue_mt_thread_mutex.
+  int n = 0;
+  for (RogueMTGCThread* cur=Rogue_mtgc_threads; cur; cur=cur->next)
   {
-    printf("Unabalanced Rogue enter/exit\n");
-    exit(1);
+    if (cur->state.load() == ROGUE_MTGC_RUNNING) ++n;
   }
-
-  --Rogue_mtgc_entered;
-  Rogue_mtgc_B1();
+  return n;
 }
 
+
+// Rogue_mtgc_enter() and Rogue_mtgc_exit() are inline in NativeCPP.h.
+thread_local int Rogue_mtgc_entered = 1;
+
 static void Rogue_mtgc_M1_M2_GC_M3 (int quit)
 {
   // M1
-  ROGUE_MUTEX_LOCK(Rogue_mtgc_w_mutex);
-  Rogue_mtgc_w = 1;
-  ROGUE_MUTEX_UNLOCK(Rogue_mtgc_w_mutex);
+  Rogue_mtgc_w.store( 1 );
 
   // M2
-#if (ROGUE_THREAD_MODE == ROGUE_THREAD_MODE_PTHREADS) && ROGUE_MTGC_DEBUG
-  ROGUE_MUTEX_LOCK(Rogue_mtgc_s_mutex);
-  while (Rogue_mtgc_s != Rogue_mt_tc)
+  // Most threads reach a poll within microseconds, so spin briefly before
+  // sleeping on the condition variable.
+  int spins = 0;
+  while (Rogue_mtgc_running_count() && ++spins < 1000)
   {
-    if (Rogue_mtgc_s > Rogue_mt_tc || Rogue_mtgc_s < 0)
-    {
-      printf("INVALID VALUE OF S %i %i\n", Rogue_mtgc_s, Rogue_mt_tc);
-      exit(1);
-    }
-
-    pthread_cond_wait(&Rogue_mtgc_s_cond, &Rogue_mtgc_s_mutex);
-  }
-  // We should actually be okay holding the S lock until the
-  // very end of the function if we want, and this would prevent
-  // threads that were blocking from ever leaving B2.  But
-  // We should be okay anyway, though S may temporarily != TC.
-  //ROGUE_MUTEX_UNLOCK(Rogue_mtgc_s_mutex);
+#if ROGUE_THREAD_MODE == ROGUE_THREAD_MODE_CPP
+    std::this_thread::yield();
 #else
-  ROGUE_COND_STARTWAIT(Rogue_mtgc_s_cond, Rogue_mtgc_s_mutex);
-  ROGUE_COND_DOWAIT(Rogue_mtgc_s_cond, Rogue_mtgc_s_mutex, Rogue_mtgc_s != Rogue_mt_tc);
+    sched_yield();
 #endif
+  }
+  ROGUE_COND_STARTWAIT(Rogue_mtgc_s_cond, Rogue_mtgc_s_mutex);
+  ROGUE_COND_DOWAIT(Rogue_mtgc_s_cond, Rogue_mtgc_s_mutex, Rogue_mtgc_running_count() != 0);
+  ROGUE_COND_ENDWAIT(Rogue_mtgc_s_cond, Rogue_mtgc_s_mutex);
 
 #if ROGUE_MTGC_DEBUG
-  ROGUE_MUTEX_LOCK(Rogue_mtgc_w_mutex);
-  Rogue_mtgc_w = 2;
-  ROGUE_MUTEX_UNLOCK(Rogue_mtgc_w_mutex);
+  Rogue_mtgc_w.store( 2 );
 #endif
 
   // GC
@@ -421,9 +687,6 @@ static void Rogue_mtgc_M1_M2_GC_M3 (int quit)
   ROGUE_GC_SOA_LOCK;
   Rogue_collect_garbage_real();
 
-  //NOTE: It's possible (Rogue_mtgc_s != Rogue_mt_tc) here, if we gave up the S
-  //      lock, though they should quickly go back to equality.
-
   if (quit)
   {
     // Run a few more times to finish up
@@ -436,10 +699,7 @@ static void Rogue_mtgc_M1_M2_GC_M3 (int quit)
   ROGUE_GC_SOA_UNLOCK;
 
   // M3
-  ROGUE_COND_NOTIFY_ALL(Rogue_mtgc_w_cond, Rogue_mtgc_w_mutex, Rogue_mtgc_w = 0);
-
-  // Could have done this much earlier
-  ROGUE_COND_ENDWAIT(Rogue_mtgc_s_cond, Rogue_mtgc_s_mutex);
+  ROGUE_COND_NOTIFY_ALL(Rogue_mtgc_w_cond, Rogue_mtgc_w_mutex, Rogue_mtgc_w.store(0));
 }
 
 static void * Rogue_mtgc_threadproc (void *)
@@ -542,13 +802,6 @@ void Rogue_configure_gc()
   }
 }
 
-// Used as part of the ROGUE_BLOCKING_CALL macro.
-template<typename RT> RT Rogue_mtgc_reenter (RT expr)
-{
-  ROGUE_ENTER;
-  return expr;
-}
-
 #include <atomic>
 
 // We do all relaxed operations on this.  It's possible this will lead to
@@ -557,19 +810,29 @@ template<typename RT> RT Rogue_mtgc_reenter (RT expr)
 // threads are synced.  But I could be wrong.  Should probably think
 // about this harder.
 std::atomic_int Rogue_allocation_bytes_until_gc(Rogue_gc_threshold);
-#define ROGUE_GC_COUNT_BYTES(__x) Rogue_allocation_bytes_until_gc.fetch_sub(__x, std::memory_order_relaxed);
+std::atomic<RogueInt64> Rogue_allocation_count(0); // Purely informational
+std::atomic<RogueInt64> Rogue_allocation_bytes(0); // Purely informational
+// The informational totals are shared cache lines, so they're only updated
+// once Runtime.count_allocations(true) asks for them.
+#define ROGUE_GC_COUNT_BYTES(__x) Rogue_allocation_bytes_until_gc.fetch_sub(__x, std::memory_order_relaxed); \
+  if (Rogue_count_allocations) \
+  { \
+    Rogue_allocation_count.fetch_add(1, std::memory_order_relaxed); \
+    Rogue_allocation_bytes.fetch_add(__x, std::memory_order_relaxed); \
+  }
 #define ROGUE_GC_AT_THRESHOLD (Rogue_allocation_bytes_until_gc.load(std::memory_order_relaxed) <= 0)
 #define ROGUE_GC_RESET_COUNT Rogue_allocation_bytes_until_gc.store(Rogue_gc_threshold, std::memory_order_relaxed);
 
 #else // Anything besides auto-mt
 
-#define ROGUE_GC_CHECK /* Does nothing in non-auto-mt modes */
-
 #define ROGUE_GC_SOA_LOCK
 #define ROGUE_GC_SOA_UNLOCK
 
 int Rogue_allocation_bytes_until_gc = Rogue_gc_threshold;
-#define ROGUE_GC_COUNT_BYTES(__x) Rogue_allocation_bytes_until_gc -= (__x);
+RogueInt64 Rogue_allocation_count = 0; // Purely informational
+RogueInt64 Rogue_allocation_bytes = 0; // Purely informational
+#define ROGUE_GC_COUNT_BYTES(__x) Rogue_allocation_bytes_until_gc -= (__x); \
+  if (Rogue_count_allocations) { ++Rogue_allocation_count; Rogue_allocation_bytes += (__x); }
 #define ROGUE_GC_AT_THRESHOLD (Rogue_allocation_bytes_until_gc <= 0)
 #define ROGUE_GC_RESET_COUNT Rogue_allocation_bytes_until_gc = Rogue_gc_threshold;
 
@@ -579,6 +842,143 @@ int Rogue_allocation_bytes_until_gc = Rogue_gc_threshold;
 
 #endif
 
+//-----------------------------------------------------------------------------
+//  RogueThinLock
+//-----------------------------------------------------------------------------
+#if ROGUE_THREAD_MODE != ROGUE_THREAD_MODE_NONE
+struct RogueThinLockMonitor
+{
+  // A recursive lock owned by a RogueThinLock thread id rather than by the
+  // calling thread, so a contender can create it on the thin owner's behalf.
+  uint64_t owner;
+  int      depth;
+  int      waiters;
+#if ROGUE_THREAD_MODE == ROGUE_THREAD_MODE_PTHREADS
+  pthread_mutex_t mutex;
+  pthread_cond_t  released;
+
+  RogueThinLockMonitor( uint64_t owner, int depth ) : owner(owner), depth(depth), waiters(0)
+  {
+    pthread_mutex_init( &mutex, NULL );
+    pthread_cond_init( &released, NULL );
+  }
+
+  ~RogueThinLockMonitor()
+  {
+    pthread_cond_destroy( &released );
+    pthread_mutex_destroy( &mutex );
+  }
+
+  void lock( uint64_t self )
+  {
+    pthread_mutex_lock( &mutex );
+    if (owner != self)
+    {
+      ++waiters;
+      while (owner) pthread_cond_wait( &released, &mutex );
+      --waiters;
+      owner = self;
+    }
+    ++depth;
+    pthread_mutex_unlock( &mutex );
+  }
+
+  void unlock()
+  {
+    pthread_mutex_lock( &mutex );
+    if (--depth == 0)
+    {
+      owner = 0;
+      if (waiters) pthread_cond_signal( &released );
+    }
+    pthread_mutex_unlock( &mutex );
+  }
+#else
+  std::mutex              mutex;
+  std::condition_variable released;
+
+  RogueThinLockMonitor( uint64_t owner, int depth ) : owner(owner), depth(depth), waiters(0) {}
+
+  void lock( uint64_t self )
+  {
+    std::unique_lock<std::mutex> guard( mutex );
+    if (owner != self)
+    {
+      ++waiters;
+      while (owner) released.wait( guard );
+      --waiters;
+      owner = self;
+    }
+    ++depth;
+  }
+
+  void unlock()
+  {
+    std::lock_guard<std::mutex> guard( mutex );
+    if (--depth == 0)
+    {
+      owner = 0;
+      if (waiters) released.notify_one();
+    }
+  }
+#endif
+};
+
+static inline RogueThinLockMonitor* RogueThinLock_monitor( uint64_t w )
+{
+  return (RogueThinLockMonitor*)(uintptr_t)(w & ~ROGUE_THIN_LOCK_INFLATED);
+}
+
+uint64_t RogueThinLock_assign_thread_id()
+{
+  static std::atomic<uint64_t> next_id( 1 );
+  return next_id.fetch_add( 1 ) << ROGUE_THIN_LOCK_ID_SHIFT;
+}
+
+void RogueThinLock_lock_slow( RogueThinLock* lock )
+{
+  uint64_t self = RogueThinLock_thread_id();
+  uint64_t w = lock->word.load( std::memory_order_acquire );
+  while ( !(w & ROGUE_THIN_LOCK_INFLATED) )
+  {
+    if (w == 0)
+    {
+      if (lock->word.compare_exchange_weak(w, self|ROGUE_THIN_LOCK_DEPTH_ONE, std::memory_order_acquire)) return;
+      continue;
+    }
+
+    // Thin-locked by another thread, or by us nested deeper than the word can
+    // count.  Either way, hand the owner and depth to a monitor.
+    RogueThinLockMonitor* monitor = new RogueThinLockMonitor(
+        w & ~ROGUE_THIN_LOCK_DEPTH_MASK, (int)((w & ROGUE_THIN_LOCK_DEPTH_MASK) / ROGUE_THIN_LOCK_DEPTH_ONE) );
+    uint64_t inflated = (uint64_t)(uintptr_t)monitor | ROGUE_THIN_LOCK_INFLATED;
+    if (lock->word.compare_exchange_strong(w, inflated, std::memory_order_acq_rel))
+    {
+      w = inflated;
+      break;
+    }
+    delete monitor;
+  }
+
+  // Don't hold up the GC while we wait.
+  ROGUE_EXIT;
+  RogueThinLock_monitor( w )->lock( self );
+  ROGUE_ENTER;
+}
+
+void RogueThinLock_unlock_slow( RogueThinLock* lock )
+{
+  RogueThinLock_monitor( lock->word.load(std::memory_order_acquire) )->unlock();
+}
+
+void RogueThinLock_cleanup( RogueThinLock* lock )
+{
+  uint64_t w = lock->word.load();
+  if (w & ROGUE_THIN_LOCK_INFLATED) delete RogueThinLock_monitor( w );
+  lock->word.store( 0 );
+}
+#endif
+
 //-----------------------------------------------------------------------------
 //  RogueDebugTrace
 //-----------------------------------------------------------------------------
@@ -729,7 +1129,7 @@ RogueObject* RogueType_singleton( RogueType* THIS )
 
     if ((fn = THIS->init_object_fn)) r = fn( r );
 
-    ROGUE_SET_SINGLETON(THIS, r);
+    RogueType_set_singleton( THIS, r );
 
     ROGUE_SINGLETON_UNLOCK;
 
@@ -1286,13 +1686,11 @@ void* RogueAllocator_allocate( RogueAllocator* THIS, int size )
 {
 #if ROGUE_GC_MODE_AUTO_MT
 #if ROGUE_MTGC_DEBUG
-    ROGUE_MUTEX_LOCK(Rogue_mtgc_w_mutex);
-    if (Rogue_mtgc_w == 2)
+    if (Rogue_mtgc_w.load() == 2)
     {
       printf("ALLOC DURING GC!\n");
       exit(1);
     }
-    ROGUE_MUTEX_UNLOCK(Rogue_mtgc_w_mutex);
 #endif
 #endif
 
@@ -1460,6 +1858,10 @@ RogueObject* RogueAllocator_allocate_object( RogueAllocator* THIS, RogueType* of
 #else
 RogueObject* RogueAllocator_allocate_object( RogueAllocator* THIS, RogueType* of_type, int size, int element_type_index )
 {
+#if ROGUE_NUMA
+  // Types name an allocator in set 0; use the same one in this thread's set.
+  if (Rogue_numa_node) THIS = Rogue_allocator_sets[ Rogue_numa_node ] + (THIS - Rogue_allocators);
+#endif
   void * mem = RogueAllocator_allocate( THIS, size );
   memset( mem, 0, size );
 
@@ -1538,9 +1940,12 @@ void RogueAllocator_free_objects( RogueAllocator* THIS )
 
 void RogueAllocator_free_all( )
 {
-  for (int i=0; i<Rogue_allocator_count; ++i)
+  for (int set=0; set<Rogue_allocator_set_count; ++set)
   {
-    RogueAllocator_free_objects( &Rogue_allocators[i] );
+    for (int i=0; i<Rogue_allocator_count; ++i)
+    {
+      RogueAllocator_free_objects( &Rogue_allocator_sets[set][i] );
+    }
   }
 }
 
@@ -1655,9 +2060,9 @@ void RogueAllocator_collect_garbage( RogueAllocator* THIS )
     int byte_count = 0;
     int object_count = 0;
 
-    for (int i=0; i<Rogue_allocator_count; ++i)
+    for (int i=0; i<Rogue_allocator_set_count*Rogue_allocator_count; ++i)
     {
-      RogueAllocator* allocator = &Rogue_allocators[i];
+      RogueAllocator* allocator = &Rogue_allocator_sets[i / Rogue_allocator_count][i % Rogue_allocator_count];
 
       RogueObject* cur = allocator->objects;
       while (cur)
@@ -1753,6 +2158,22 @@ _rogue_init_mutex(&Rogue_thread_singleton_lock);
 
   // Initialize allocators
   memset( Rogue_allocators, 0, sizeof(RogueAllocator)*Rogue_allocator_count );
+  Rogue_allocator_sets[0] = Rogue_allocators;
+
+#if ROGUE_THREAD_MODE != ROGUE_THREAD_MODE_NONE
+  // Read the topology before any other thread can ask for it.
+  RogueTopology_load();
+#endif
+
+#if ROGUE_NUMA
+  Rogue_allocator_set_count = RogueTopology_node_count();
+  if (Rogue_allocator_set_count > ROGUE_NUMA_NODE_LIMIT) Rogue_allocator_set_count = ROGUE_NUMA_NODE_LIMIT;
+  for (i=1; i<Rogue_allocator_set_count; ++i)
+  {
+    Rogue_allocator_sets[i] = (RogueAllocator*) calloc( Rogue_allocator_count, sizeof(RogueAllocator) );
+  }
+  Rogue_numa_set_node( RogueTopology_current_node() );
+#endif
 
 #ifdef ROGUE_INTROSPECTION
   int global_property_pointer_cursor = 0;
@@ -1914,6 +2335,7 @@ static inline void Rogue_collect_garbage_real()
   if (Rogue_gc_active) return;
   Rogue_gc_active = true;
   ++ Rogue_gc_count;
+  auto gc_start = std::chrono::steady_clock::now();
 
 //printf( "GC %d\n", Rogue_allocation_bytes_until_gc );
   ROGUE_GC_RESET_COUNT;
@@ -1922,12 +2344,17 @@ static inline void Rogue_collect_garbage_real()
 
   Rogue_trace();
 
-  for (int i=0; i<Rogue_allocator_count; ++i)
+  for (int set=0; set<Rogue_allocator_set_count; ++set)
   {
-    RogueAllocator_collect_garbage( &Rogue_allocators[i] );
+    for (int i=0; i<Rogue_allocator_count; ++i)
+    {
+      RogueAllocator_collect_garbage( &Rogue_allocator_sets[set][i] );
+    }
   }
 
   Rogue_on_gc_end.call();
+  Rogue_gc_microseconds += std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - gc_start ).count();
   Rogue_gc_active = false;
 }
 
@@ -40,6 +40,7 @@
 #  include <cstdint>
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -70,7 +71,12 @@
 inline void Rogue_mtgc_enter (void);
 inline void Rogue_mtgc_exit (void);
 
-template<typename RT> RT Rogue_mtgc_reenter (RT expr);
+// Used as part of the ROGUE_BLOCKING_CALL macro.
+template<typename RT> RT Rogue_mtgc_reenter (RT expr)
+{
+  ROGUE_ENTER;
+  return expr;
+}
 
 #define ROGUE_BLOCKING_CALL(__x) (ROGUE_EXIT, Rogue_mtgc_reenter((__x)))
 #define ROGUE_BLOCKING_VOID_CALL(__x) do {ROGUE_EXIT; __x; ROGUE_ENTER;}while(false)
@@ -356,12 +362,6 @@ public:
   }
 };
 
-#define ROGUE_SYNC_OBJECT_TYPE pthread_mutex_t
-#define ROGUE_SYNC_OBJECT_INIT _rogue_init_mutex(&THIS->_object_mutex);
-#define ROGUE_SYNC_OBJECT_CLEANUP pthread_mutex_destroy(&THIS->_object_mutex);
-#define ROGUE_SYNC_OBJECT_ENTER RogueUnlocker _unlocker(THIS->_object_mutex);
-#define ROGUE_SYNC_OBJECT_EXIT
-
 #elif ROGUE_THREAD_MODE == ROGUE_THREAD_MODE_CPP
 
 #include <thread>
@@ -385,12 +385,6 @@ public:
   }
 };
 
-#define ROGUE_SYNC_OBJECT_TYPE std::recursive_mutex
-#define ROGUE_SYNC_OBJECT_INIT
-#define ROGUE_SYNC_OBJECT_CLEANUP
-#define ROGUE_SYNC_OBJECT_ENTER RogueUnlocker _unlocker(THIS->_object_mutex);
-#define ROGUE_SYNC_OBJECT_EXIT
-
 #else
 
 #define ROGUE_SYNC_OBJECT_TYPE
@@ -404,6 +398,193 @@ public:
 
 #endif
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+inline int Rogue_leading_zeros( uint32_t n )
+{
+  // Number of leading zero bits in 'n'; 32 for 0.
+  if ( !n ) return 32;
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanReverse( &index, n );
+  return 31 - (int)index;
+#else
+  return __builtin_clz( n );
+#endif
+}
+
+#if ROGUE_THREAD_MODE != ROGUE_THREAD_MODE_NONE
+template <typename T>
+inline std::atomic<T>& RogueAtomic_ref( T& value )
+{
+  // Atomic access to a plain field such as a Rogue object reference, which
+  // has to stay a plain pointer so the GC can trace it.
+  static_assert( sizeof(std::atomic<T>) == sizeof(T), "std::atomic<T> must have the same layout as T" );
+  return *reinterpret_cast<std::atomic<T>*>( &value );
+}
+#endif
+
+#if ROGUE_THREAD_MODE != ROGUE_THREAD_MODE_NONE
+// The per-object lock of [synchronized] types.  A single word holds either
+// the owning thread's id (high bits) and recursion depth (bits 1-15), or -
+// once a second thread has contended for the lock - a pointer to a monitor
+// tagged with the low bit.  A contending thread inflates the word on the
+// owner's behalf, moving its id and depth into the monitor, and then sleeps
+// until an unlock wakes it.  Since the word can change under the owner, the
+// owner updates it with compare-and-swap too.  Inflated locks stay inflated
+// until the object is freed.
+#define ROGUE_THIN_LOCK_INFLATED   ((uint64_t)1)
+#define ROGUE_THIN_LOCK_DEPTH_ONE  ((uint64_t)2)
+#define ROGUE_THIN_LOCK_DEPTH_MASK ((uint64_t)0xFFFE)
+#define ROGUE_THIN_LOCK_ID_SHIFT   16
+
+struct RogueThinLock
+{
+  std::atomic<uint64_t> word;
+};
+
+uint64_t RogueThinLock_assign_thread_id();
+void     RogueThinLock_lock_slow( RogueThinLock* lock );
+void     RogueThinLock_unlock_slow( RogueThinLock* lock );
+void     RogueThinLock_cleanup( RogueThinLock* lock );
+
+inline uint64_t RogueThinLock_thread_id()
+{
+  static thread_local uint64_t id = 0;
+  if ( !id ) id = RogueThinLock_assign_thread_id();
+  return id;
+}
+
+inline void RogueThinLock_lock( RogueThinLock* lock )
+{
+  uint64_t w = 0;
+  uint64_t self = RogueThinLock_thread_id();
+  if (lock->word.compare_exchange_strong(w, self|ROGUE_THIN_LOCK_DEPTH_ONE, std::memory_order_acquire)) return;
+
+  if ( !(w & ROGUE_THIN_LOCK_INFLATED) && (w & ~ROGUE_THIN_LOCK_DEPTH_MASK) == self
+      && (w & ROGUE_THIN_LOCK_DEPTH_MASK) != ROGUE_THIN_LOCK_DEPTH_MASK )
+  {
+    if (lock->word.compare_exchange_strong(w, w + ROGUE_THIN_LOCK_DEPTH_ONE, std::memory_order_relaxed)) return;
+  }
+
+  RogueThinLock_lock_slow( lock );
+}
+
+inline void RogueThinLock_unlock( RogueThinLock* lock )
+{
+  uint64_t w = lock->word.load( std::memory_order_relaxed );
+  if ( !(w & ROGUE_THIN_LOCK_INFLATED) )
+  {
+    uint64_t next = ((w & ROGUE_THIN_LOCK_DEPTH_MASK) == ROGUE_THIN_LOCK_DEPTH_ONE) ? 0 : w - ROGUE_THIN_LOCK_DEPTH_ONE;
+    if (lock->word.compare_exchange_strong(w, next, std::memory_order_release, std::memory_order_relaxed)) return;
+    // Inflated by a contending thread since we loaded the word.
+  }
+  RogueThinLock_unlock_slow( lock );
+}
+
+class RogueThinLockGuard
+{
+  RogueThinLock & lock;
+public:
+  RogueThinLockGuard( RogueThinLock & lock )
+  : lock(lock)
+  {
+    RogueThinLock_lock( &lock );
+  }
+  ~RogueThinLockGuard (void)
+  {
+    RogueThinLock_unlock( &lock );
+  }
+};
+
+#define ROGUE_SYNC_OBJECT_TYPE RogueThinLock
+#define ROGUE_SYNC_OBJECT_INIT THIS->_object_mutex.word.store( 0 );
+#define ROGUE_SYNC_OBJECT_CLEANUP RogueThinLock_cleanup(&THIS->_object_mutex);
+#define ROGUE_SYNC_OBJECT_ENTER RogueThinLockGuard _unlocker(THIS->_object_mutex);
+#define ROGUE_SYNC_OBJECT_EXIT
+#endif
+
+// This is how unlikely() works in the Linux kernel
+#define ROGUE_UNLIKELY(_X) __builtin_expect(!!(_X), 0)
+
+// Singleton handling
+#if ROGUE_THREAD_MODE
+#define ROGUE_GET_SINGLETON(_S) (_S)->_singleton.load()
+#define ROGUE_SET_SINGLETON(_S,_V) (_S)->_singleton.store(_V,std::memory_order_release);
+#else
+#define ROGUE_GET_SINGLETON(_S) (_S)->_singleton
+#define ROGUE_SET_SINGLETON(_S,_V) (_S)->_singleton = _V;
+#endif
+
+// GC safepoint polled by generated code at loop back-edges and method entry.
+// See "Safepoints" in NativeCPP.cpp.
+#if ROGUE_GC_MODE_AUTO_MT
+extern std::atomic_int Rogue_mtgc_w;
+extern thread_local bool Rogue_mtgc_is_gc_thread;
+void Rogue_mtgc_park ();
+
+#define ROGUE_GC_CHECK if (ROGUE_UNLIKELY(Rogue_mtgc_w.load(std::memory_order_relaxed)) \
+  && !ROGUE_UNLIKELY(Rogue_mtgc_is_gc_thread))                                        \
+  Rogue_mtgc_park();
+
+// The safepoint state each registered thread publishes for the GC.
+#define ROGUE_MTGC_RUNNING 0 // Running Rogue code
+#define ROGUE_MTGC_SAFE    1 // Outside Rogue code (ROGUE_EXIT) or parked at a safepoint
+
+struct RogueMTGCThread
+{
+  std::atomic_int  state;
+  RogueMTGCThread* next;
+};
+
+extern thread_local RogueMTGCThread* Rogue_mtgc_this_thread;
+extern thread_local int Rogue_mtgc_entered;
+void Rogue_mtgc_notify_safe ();
+
+inline void Rogue_mtgc_enter()
+{
+  if (ROGUE_UNLIKELY(Rogue_mtgc_is_gc_thread)) return;
+  if (ROGUE_UNLIKELY(Rogue_mtgc_entered))
+#ifdef ROGUE_MTGC_DEBUG
+  {
+    printf("ALREADY ENTERED\n");
+    exit(1);
+  }
+#else
+  {
+    ++Rogue_mtgc_entered;
+    return;
+  }
+#endif
+
+  Rogue_mtgc_entered = 1;
+  RogueMTGCThread* self = Rogue_mtgc_this_thread;
+  if ( !self ) return;
+  self->state.store( ROGUE_MTGC_RUNNING );
+  if (ROGUE_UNLIKELY(Rogue_mtgc_w.load())) Rogue_mtgc_park();
+}
+
+inline void Rogue_mtgc_exit()
+{
+  if (ROGUE_UNLIKELY(Rogue_mtgc_is_gc_thread)) return;
+  if (ROGUE_UNLIKELY(Rogue_mtgc_entered <= 0))
+  {
+    printf("Unabalanced Rogue enter/exit\n");
+    exit(1);
+  }
+
+  if (--Rogue_mtgc_entered) return; // Still inside an outer ROGUE_ENTER
+  RogueMTGCThread* self = Rogue_mtgc_this_thread;
+  if ( !self ) return;
+  self->state.store( ROGUE_MTGC_SAFE );
+  if (ROGUE_UNLIKELY(Rogue_mtgc_w.load())) Rogue_mtgc_notify_safe();
+}
+#else
+#define ROGUE_GC_CHECK /* Does nothing in non-auto-mt modes */
+#endif
+
 
 //-----------------------------------------------------------------------------
 //  Basics (Primitive types, macros, etc.)
@@ -436,8 +617,13 @@ struct RogueString;
 #define ROGUE_CREATE_OBJECT(name) RogueType_create_object(RogueType##name,0)
   //e.g. RogueType_create_object(RogueStringBuilder,0)
 
-#define ROGUE_SINGLETON(name) RogueType_singleton(RogueType##name)
-  //e.g. RogueType_singleton( RogueTypeConsole )
+#define ROGUE_SINGLETON(name) RogueType_singleton_fast(RogueType##name)
+  //e.g. RogueType_singleton_fast( RogueTypeConsole )
+
+#define ROGUE_ESSENTIAL_SINGLETON(name) Rogue_cached_singleton(RogueSingleton##name,RogueType##name)
+  // Essential singletons also get a generated RogueSingleton<name> pointer
+  // that is filled in at launch and kept in step with the type's _singleton
+  // by RogueType_set_singleton(), so accessing one is a single load.
 
 #define ROGUE_PROPERTY(name) p_##name
 
@@ -495,6 +681,16 @@ struct RogueCallbackInfo
 //-----------------------------------------------------------------------------
 //  RogueType
 //-----------------------------------------------------------------------------
+#if (ROGUE_THREAD_MODE == ROGUE_THREAD_MODE_PTHREADS) || (ROGUE_THREAD_MODE == ROGUE_THREAD_MODE_CPP)
+  #define ROGUE_SINGLETON_CACHE_TYPE std::atomic<RogueObject*>
+  #define ROGUE_SINGLETON_CACHE_LOAD(_c_) (_c_).load( std::memory_order_acquire )
+  #define ROGUE_SINGLETON_CACHE_STORE(_c_,_v_) (_c_).store( _v_, std::memory_order_release )
+#else
+  #define ROGUE_SINGLETON_CACHE_TYPE RogueObject*
+  #define ROGUE_SINGLETON_CACHE_LOAD(_c_) (_c_)
+  #define ROGUE_SINGLETON_CACHE_STORE(_c_,_v_) (_c_) = (_v_)
+#endif
+
 struct RogueType
 {
   RogueObject* type_info;
@@ -523,6 +719,7 @@ struct RogueType
 #else
   RogueObject* _singleton;
 #endif
+  ROGUE_SINGLETON_CACHE_TYPE* singleton_cache; // RogueSingleton<name> of an essential singleton
   const void** methods; // first function pointer in Rogue_dynamic_method_table
   int          method_count;
 
@@ -549,6 +746,28 @@ ROGUE_EXPORT_C void         RogueType_print_name( RogueType* THIS );
 ROGUE_EXPORT_C RogueType*   RogueType_retire( RogueType* THIS );
 ROGUE_EXPORT_C RogueObject* RogueType_singleton( RogueType* THIS );
 
+inline RogueObject* RogueType_singleton_fast( RogueType* THIS )
+{
+  // Once created, a singleton is only read; creation stays out of line.
+  RogueObject* r = ROGUE_SINGLETON_CACHE_LOAD( THIS->_singleton );
+  return r ? r : RogueType_singleton( THIS );
+}
+
+inline void RogueType_set_singleton( RogueType* THIS, RogueObject* singleton )
+{
+  // Every store to _singleton goes through here so that an essential
+  // singleton's cache never holds an object the GC no longer traces.
+  ROGUE_SET_SINGLETON( THIS, singleton )
+  if (THIS->singleton_cache) ROGUE_SINGLETON_CACHE_STORE( *THIS->singleton_cache, singleton );
+}
+
+inline RogueObject* Rogue_cached_singleton( ROGUE_SINGLETON_CACHE_TYPE& cache, RogueType* type )
+{
+  // Empty only while launching, before the essential singletons are created.
+  RogueObject* r = ROGUE_SINGLETON_CACHE_LOAD( cache );
+  return r ? r : RogueType_singleton_fast( type );
+}
+
 
 //-----------------------------------------------------------------------------
 //  RogueObject
@@ -741,6 +960,55 @@ void         RogueAllocator_free_objects( RogueAllocator* THIS );
 void         RogueAllocator_free_all();
 void         RogueAllocator_collect_garbage( RogueAllocator* THIS );
 
+
+//-----------------------------------------------------------------------------
+//  RogueTopology
+//-----------------------------------------------------------------------------
+// The CPUs this process may run on and where they sit: NUMA node, package
+// (socket), physical core and hardware thread.  Read from /sys on Linux;
+// elsewhere every CPU is reported as its own core on node 0.
+//
+// With ROGUE_NUMA, each NUMA node also gets its own set of allocators.  A
+// thread allocates from the set of the node it was running on when it
+// registered or was last pinned, so the pages behind its objects are
+// first-touched - and therefore placed - on that node.
+#ifndef ROGUE_NUMA
+#  if defined(__linux__) && ROGUE_THREAD_MODE != ROGUE_THREAD_MODE_NONE && !ROGUE_GC_MODE_BOEHM
+#    define ROGUE_NUMA 1
+#  else
+#    define ROGUE_NUMA 0
+#  endif
+#endif
+
+#ifndef ROGUE_NUMA_NODE_LIMIT
+#  define ROGUE_NUMA_NODE_LIMIT 16
+#endif
+
+#define ROGUE_TOPOLOGY_CPU_LIMIT 1024
+
+// Worker placement policies
+#define ROGUE_PLACEMENT_UNPINNED 0  // leave scheduling to the OS
+#define ROGUE_PLACEMENT_COMPACT  1  // fill each core, then each node, before the next
+#define ROGUE_PLACEMENT_SCATTER  2  // round-robin across nodes, then cores, then SMT siblings
+
+struct RogueCPUInfo
+{
+  int id;       // OS CPU number
+  int node;     // NUMA node, numbered 0..node_count-1 in node id order
+  int package;
+  int core;     // physical core id within its package
+  int thread;   // 0 for the first hardware thread of a core, 1 for its sibling, ...
+};
+
+int                 RogueTopology_cpu_count();
+RogueCPUInfo*       RogueTopology_cpu( int index );
+int                 RogueTopology_node_count();
+int                 RogueTopology_node_of( int cpu_id );
+int                 RogueTopology_current_cpu();
+int                 RogueTopology_current_node();
+int                 RogueTopology_placement( int policy, int worker_index );
+bool                RogueTopology_pin_current_thread( int cpu_id );
+
 extern int                Rogue_allocator_count;
 extern RogueAllocator     Rogue_allocators[];
 extern int                Rogue_type_count;